@@ -0,0 +1,214 @@
+#ifndef CC_UTIL_SEGMENTER_H
+#define CC_UTIL_SEGMENTER_H
+
+#include <opencv2/core/core.hpp>
+#include <algorithm>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace cc_util
+{
+
+// write thresholds the way cc_util saves them, a "colors" sequence of
+// { color, mins { h s v }, maxs { h s v } }. thresholds[i] is
+// { { h_l, s_l, v_l }, { h_u, s_u, v_u } } and is named names[i].
+inline void writeColors(cv::FileStorage &fs,
+                        const std::vector<std::vector<std::vector<int> > > &thresholds,
+                        const std::vector<std::string> &names)
+{
+  fs << "colors" << "[";
+  for (unsigned i = 0; i < thresholds.size(); ++i)
+  {
+    fs << "{";
+    fs << "color" << names[i];
+
+    // map mins to h s v key value pairs
+    fs << "mins" << "{";
+    fs << "h" << thresholds[i][0][0];
+    fs << "s" << thresholds[i][0][1];
+    fs << "v" << thresholds[i][0][2];
+    fs << "}";
+
+    // map maxs to h s v key value pairs
+    fs << "maxs" << "{";
+    fs << "h" << thresholds[i][1][0];
+    fs << "s" << thresholds[i][1][1];
+    fs << "v" << thresholds[i][1][2];
+    fs << "}";
+
+    fs << "}";
+  }
+  fs << "]";
+}
+
+// Classifies every pixel of an hsv image against a set of thresholds in
+// one pass, producing a label image. Label 0 is "nothing", label k is
+// colorName(k). Thresholds sharing a color name (the hue-wrapped pairs
+// cc_util writes for red and friends) share a label.
+//
+// For each channel there is a 256 entry table whose bit t is set when a
+// value is inside threshold t, so a pixel is just three lookups and two
+// ands, no matter how many thresholds there are.
+class ColorSegmenter
+{
+  public:
+  static const unsigned MAX_THRESHOLDS = 32;
+
+  ColorSegmenter()
+  {
+    clear();
+  }
+
+  void clear()
+  {
+    names.clear();
+    thresholdLabels.clear();
+    for (int v = 0; v < 256; ++v)
+      lutH[v] = lutS[v] = lutV[v] = 0;
+  }
+
+  // add an hsv range, inclusive at both ends. Returns false if there
+  // are already MAX_THRESHOLDS of them.
+  bool addThreshold(const std::string &color,
+                    int h_l, int s_l, int v_l,
+                    int h_u, int s_u, int v_u)
+  {
+    if (thresholdLabels.size() >= MAX_THRESHOLDS)
+      return false;
+
+    uint32_t bit = 1u << thresholdLabels.size();
+    setRange(lutH, bit, h_l, h_u);
+    setRange(lutS, bit, s_l, s_u);
+    setRange(lutV, bit, v_l, v_u);
+
+    // same color, same label
+    unsigned label = 0;
+    while (label < names.size() && names[label] != color)
+      ++label;
+    if (label == names.size())
+      names.push_back(color);
+    thresholdLabels.push_back(static_cast<uchar>(label + 1));
+    return true;
+  }
+
+  // read the thresholds from a yaml file written by cc_util (see
+  // writeColors). On failure nothing is loaded, never part of a file.
+  bool load(const std::string &yamlFile)
+  {
+    clear();
+
+    cv::FileStorage fs(yamlFile, cv::FileStorage::READ);
+    if (!fs.isOpened())
+      return false;
+
+    cv::FileNode colors = fs["colors"];
+    if (!colors.isSeq())
+      return false;
+
+    for (unsigned i = 0; i < colors.size(); ++i)
+    {
+      cv::FileNode color = colors[i]["color"];
+      cv::FileNode mins = colors[i]["mins"], maxs = colors[i]["maxs"];
+      if (!color.isString() || !isHSV(mins) || !isHSV(maxs) ||
+          !addThreshold((std::string)color,
+                        (int)mins["h"], (int)mins["s"], (int)mins["v"],
+                        (int)maxs["h"], (int)maxs["s"], (int)maxs["v"]))
+      {
+        clear();
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool empty() const
+  {
+    return thresholdLabels.empty();
+  }
+
+  // number of labels, not counting 0
+  unsigned numLabels() const
+  {
+    return names.size();
+  }
+
+  const std::string &colorName(unsigned label) const
+  {
+    return names[label - 1];
+  }
+
+  // hsv must be CV_8UC3, as from cvtColor(..., CV_BGR2HSV). labels is
+  // (re)allocated as CV_8UC1 of the same size.
+  void segment(const cv::Mat &hsv, cv::Mat &labels) const
+  {
+    CV_Assert(hsv.type() == CV_8UC3);
+    labels.create(hsv.size(), CV_8UC1);
+
+    int rows = hsv.rows, cols = hsv.cols;
+    if (hsv.isContinuous() && labels.isContinuous())
+    {
+      cols *= rows;
+      rows = 1;
+    }
+
+    // threshold -> label, with a last entry of 0 for the NO_HIT bit, so
+    // the first threshold that matches (or none) is one lookup, no branch
+    uchar labelOf[MAX_THRESHOLDS + 1] = { 0 };
+    for (unsigned t = 0; t < thresholdLabels.size(); ++t)
+      labelOf[t] = thresholdLabels[t];
+
+    for (int y = 0; y < rows; ++y)
+    {
+      const uchar *p = hsv.ptr<uchar>(y);
+      uchar *out = labels.ptr<uchar>(y);
+      for (int x = 0; x < cols; ++x, p += 3)
+      {
+        uint32_t hits = lutH[p[0]] & lutS[p[1]] & lutV[p[2]];
+        out[x] = labelOf[firstBit(hits | NO_HIT)];
+      }
+    }
+  }
+
+  private:
+  static const uint64_t NO_HIT = 1ull << MAX_THRESHOLDS;
+
+  static bool isHSV(const cv::FileNode &node)
+  {
+    return node.isMap() && node["h"].isInt() &&
+           node["s"].isInt() && node["v"].isInt();
+  }
+
+  static void setRange(uint32_t *lut, uint32_t bit, int lower, int upper)
+  {
+    lower = std::max(lower, 0);
+    upper = std::min(upper, 255);
+    for (int v = lower; v <= upper; ++v)
+      lut[v] |= bit;
+  }
+
+  // index of the lowest bit set, the first threshold added wins when
+  // several match
+  static unsigned firstBit(uint64_t bits)
+  {
+#ifdef __GNUC__
+    return __builtin_ctzll(bits);
+#else
+    unsigned t = 0;
+    while (!(bits & 1u))
+    {
+      bits >>= 1;
+      ++t;
+    }
+    return t;
+#endif
+  }
+
+  std::vector<std::string> names;     // label - 1 -> color name
+  std::vector<uchar> thresholdLabels; // threshold -> label
+  uint32_t lutH[256], lutS[256], lutV[256];
+};
+
+}
+
+#endif
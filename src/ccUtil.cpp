@@ -7,6 +7,10 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <yaml-cpp/yaml.h>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <cc_util/segmenter.h>
 #include <fstream> 
 #include <iostream>
 #include <vector>
@@ -15,12 +19,17 @@
 #include <algorithm>
 #include <functional>
 #include <numeric>
+#include <iterator>
+#include <stdint.h>
+#include <cstring>
+#include <cstdlib>
 
 enum yaml_io { sunny = 0, cloudy, overcast };
 enum channels { _H = 0, _S, _V, _numchannels };
 enum values { _max = 0, _min, _avg, _stddev, _numvalues };
 enum _colors { _red = 0, _green, _blue, _purple,
 	       _yellow, _orange, _numcolors };
+enum records { _rec_frame = 0, _rec_mouse, _rec_key, _rec_yaml, _rec_repeat };
 
 namespace enc = sensor_msgs::image_encodings;
 
@@ -28,14 +37,22 @@ namespace enc = sensor_msgs::image_encodings;
 static const char WINDOW[] = "Color Calibration Utility";
 static const char TOPIC[]  = "/camera1/image_raw";
 static const char PATH[] = "/home/csrobot/.calibrations/";
+static const char REPLAY_PATH[] = "/tmp/";
 static const int NUM_STDDEVS = 2.0;
+static const int TILE_ROWS = 16;
+static const int REC_PNG_COMPRESSION = 3; // 0-9, more is smaller but slower
+
+// recordings start with this, followed by records of the form
+// <uint8 type> <double seconds since start> <payload>, native endianness
+static const char REC_MAGIC[] = "CCREC001";
 
 class CCUtil
 {
-  ros::NodeHandle nh;
-  image_transport::ImageTransport it;
+  // only made when live, making a NodeHandle starts the node
+  boost::scoped_ptr<ros::NodeHandle> nh;
+  boost::scoped_ptr<image_transport::ImageTransport> it;
   image_transport::Subscriber image_sub;
-  cv::Mat currentFrame;
+  cv::Mat rawFrame;         // the last frame as it came in, doAll measures it
   cv::Rect box;
   bool isDrawingBox, isPaused;
   std::vector<std::string> colorUsed; // LABELLING FIX: a unique list of all colors selected 
@@ -49,10 +66,42 @@ class CCUtil
   // bool sunnyExists, overcastExists, cloudyExists;
   int framesToShowSaveMsg;
   std::map<int, std::string> colorNames ;
+  std::string path;         // where the yaml files go
+  bool isHeadless;          // replaying: no window, no subscription
+  std::ofstream recording;  // open if we are recording a session
+  cv::Mat lastRecorded;     // so repeated frames are not stored again
+  ros::WallTime recordStart;
+  cc_util::ColorSegmenter segmenter; // live preview of the thresholds
+  std::vector<cv::Vec3b> maskColors; // overlay color of each label
+  cv::Mat maskLabels;
+  cv::Mat displayFrame;     // rawFrame with the preview, boxes etc. on top
+  cv::Mat hsvFrame;         // rawFrame in hsv, while the preview is on
+  bool showMask;
+
+  // statistics of one strip of rows of a box, see findRanges
+  struct RangeTile
+  {
+    unsigned color;
+    cv::Rect rows;
+    int64_t count;
+    int64_t sum[_numchannels], sumSq[_numchannels];
+    int max[_numchannels], min[_numchannels];
+  };
+
+  // findRanges' workers, started once and woken for each call
+  boost::thread_group rangeWorkers;
+  boost::mutex rangeLock;
+  boost::condition_variable rangeWork, rangeDone;
+  const cv::Mat *rangeImage;
+  bool rangeIsHSV;                    // rangeImage is hsv already
+  std::vector<RangeTile> *rangeTiles; // 0 when there is no job
+  unsigned rangeNext, rangeBusy, rangeJob;
+  bool rangeQuit;
 
   public:
-  CCUtil()
-    : it(nh)
+  CCUtil(const std::string &outPath, const std::string &recordFile,
+         bool headless)
+    : path(outPath), isHeadless(headless)
   {
     // ugly inits i'm sorry ;_;
     colors["YELLOW"] = cv::Scalar(0, 255, 255);
@@ -69,16 +118,13 @@ class CCUtil
     allBoxes["GREEN"]  = std::vector<cv::Rect>();
     allBoxes["BLUE"]   = std::vector<cv::Rect>(); 
 
-    image_sub = it.subscribe(TOPIC, 1, &CCUtil::imageCb, this);
-
     // defaults, defaults
-    cv::namedWindow(WINDOW);
     workingColor = "BLUE";
-    cv::setMouseCallback(WINDOW, &mouseCbWrapper, this);
     boxColors = std::vector<std::string>();
     box = cv::Rect(-1, -1, 0, 0);
     isDrawingBox = false;
     isPaused     = false;
+    showMask     = true;
     // sunnyExists    = false;
     // overcastExists = false;
     // cloudyExists   = false;
@@ -88,26 +134,79 @@ class CCUtil
     // make sure the the path we are saving the calibrations to exists
 
     struct stat st;
-    if (stat(PATH, &st) != 0)
+    if (stat(path.c_str(), &st) != 0)
     {
-      ROS_ERROR("Directory \"%s\" does not exist, please make it :)", PATH);
+      ROS_ERROR("Directory \"%s\" does not exist, please make it :)",
+                path.c_str());
       exit(1);
     }
+
+    // the calling thread works too, so one less than there are cores
+    rangeImage = 0;
+    rangeIsHSV = false;
+    rangeTiles = 0;
+    rangeNext = rangeBusy = rangeJob = 0;
+    rangeQuit = false;
+    unsigned numThreads = std::max(1u, boost::thread::hardware_concurrency());
+    for (unsigned t = 1; t < numThreads; ++t)
+      rangeWorkers.create_thread(boost::bind(&CCUtil::rangeWorker, this));
+
+    // a replay feeds frames and events in itself, nothing to show
+    if (isHeadless)
+      return;
+
+    if (!recordFile.empty())
+    {
+      recording.open(recordFile.c_str(), std::ios::out | std::ios::binary);
+      if (!recording)
+      {
+        ROS_ERROR("Could not open recording \"%s\"", recordFile.c_str());
+        exit(1);
+      }
+      recording.write(REC_MAGIC, sizeof(REC_MAGIC) - 1);
+      recordStart = ros::WallTime::now();
+      ROS_INFO("Recording session to \"%s\"", recordFile.c_str());
+    }
+
+    nh.reset(new ros::NodeHandle);
+    it.reset(new image_transport::ImageTransport(*nh));
+    image_sub = it->subscribe(TOPIC, 1, &CCUtil::imageCb, this);
+    cv::namedWindow(WINDOW);
+    cv::setMouseCallback(WINDOW, &mouseCbWrapper, this);
     printCLI();
   }
 
   ~CCUtil()
   {
-    cv::destroyWindow(WINDOW);
+    {
+      boost::mutex::scoped_lock lock(rangeLock);
+      rangeQuit = true;
+      rangeWork.notify_all();
+    }
+    rangeWorkers.join_all();
+
+    if (!isHeadless)
+      cv::destroyWindow(WINDOW);
+  }
+
+  // full path of the yaml file a calibration channel is saved to
+  std::string yamlFile(int channel)
+  {
+    switch(channel)
+    {
+    case cloudy:
+      return path + std::string("cloudy.yml");
+    case overcast:
+      return path + std::string("overcast.yml");
+    default:
+      return path + std::string("sunny.yml");
+    }
   }
 
   //output thresholds as yaml
   void output_YAML(std::vector<std::vector<std::vector<int> > > &output,
 		    int channel)
   {
-    //get the path from predefined constant
-    std::string path(PATH);
-   
     ROS_INFO("These were the colors used:");
 
     std::map<std::string, std::vector<cv::Rect> >::iterator it;
@@ -127,22 +226,8 @@ class CCUtil
 
     ROS_INFO("# colors used= %d # thresholds (+1 if red) = %d", colorUsed.size(),  output.size()); 
 
-    //cv::FileStorage built-in class
-    cv::FileStorage fs;
-
-    //open the file depending on input
-    switch(channel)
-    {
-    case sunny:
-      fs.open((path + std::string("sunny.yml")).c_str(), cv::FileStorage::WRITE);
-      break;
-    case cloudy:
-      fs.open((path + std::string("cloudy.yml")).c_str(), cv::FileStorage::WRITE);
-      break;
-    case overcast:
-      fs.open((path + std::string("overcast.yml")).c_str(), cv::FileStorage::WRITE);
-      break;
-    }
+    //cv::FileStorage built-in class, file depends on input
+    cv::FileStorage fs(yamlFile(channel), cv::FileStorage::WRITE);
 
     // check output of colors used
     for (unsigned i = 0; i < output.size(); ++i)
@@ -152,34 +237,8 @@ class CCUtil
 
 
     
-    //output 'colors' sequence    
-    fs << "colors" << "[";
-    for (unsigned i = 0; i < output.size(); ++i) 
-    {
-      fs << "{";
-      //added field that contains the names of the color
-      //fs << "color" << colorNames[i].c_str() ;
-      fs << "color" << colorUsed[i].c_str();
-
-      // map mins to
-      fs << "mins" << "{";
-      // h s v key value pairs
-      fs << "h" << output[i][0][0];
-      fs << "s" << output[i][0][1];
-      fs << "v" << output[i][0][2];
-      fs << "}";
-      
-      // map maxs to
-      fs << "maxs" << "{";
-      // h s v key value pairs
-      fs << "h" << output[i][1][0];
-      fs << "s" << output[i][1][1];
-      fs << "v" << output[i][1][2];
-      fs << "}";
-      
-      fs << "}"; 
-    }
-    fs << "]";
+    //output 'colors' sequence, the format ColorSegmenter::load reads
+    cc_util::writeColors(fs, output, colorUsed);
     //close file
     fs.release();
   }
@@ -195,137 +254,172 @@ class CCUtil
     return;
   } 
   
+  // accumulate a tile's statistics row by row, the way image is laid out.
+  // only the tile itself is converted to hsv, so the conversion is done in
+  // parallel too and costs no more than the boxes' area
+  static void tileStats(const cv::Mat &image, bool isHSV, RangeTile &tile)
+  {
+    cv::Mat hsv;
+    if (isHSV)
+      hsv = image(tile.rows);
+    else
+      cvtColor(image(tile.rows), hsv, CV_BGR2HSV);
+
+    tile.count = 0;
+    for (int c = 0; c < _numchannels; ++c)
+    {
+      tile.sum[c] = tile.sumSq[c] = 0;
+      tile.max[c] = 0;
+      tile.min[c] = 255;
+    }
+
+    for (int y = 0; y < hsv.rows; ++y)
+    {
+      const uchar *p = hsv.ptr<uchar>(y);
+      for (int x = 0; x < tile.rows.width; ++x, p += _numchannels)
+      {
+        for (int c = 0; c < _numchannels; ++c)
+        {
+          int v = p[c];
+          tile.sum[c] += v;
+          tile.sumSq[c] += v * v;
+          if (v > tile.max[c])
+            tile.max[c] = v;
+          if (v < tile.min[c])
+            tile.min[c] = v;
+        }
+      }
+    }
+    tile.count = static_cast<int64_t>(tile.rows.width) * tile.rows.height;
+  }
+
+  // keep grabbing the next unprocessed tile of the current job until
+  // there are none left. Called and returns with rangeLock held.
+  void takeTiles(boost::mutex::scoped_lock &lock)
+  {
+    ++rangeBusy;
+    while (rangeTiles && rangeNext < rangeTiles->size())
+    {
+      RangeTile &tile = (*rangeTiles)[rangeNext++];
+      lock.unlock();
+      tileStats(*rangeImage, rangeIsHSV, tile);
+      lock.lock();
+    }
+    if (--rangeBusy == 0)
+      rangeDone.notify_all();
+  }
+
+  // a pool thread, sleeps until findRanges has a new job
+  void rangeWorker()
+  {
+    unsigned seen = 0;
+    boost::mutex::scoped_lock lock(rangeLock);
+    for (;;)
+    {
+      while (!rangeQuit && rangeJob == seen)
+        rangeWork.wait(lock);
+      if (rangeQuit)
+        return;
+      seen = rangeJob;
+      takeTiles(lock);
+    }
+  }
+
   //find min, max, mean, stddev for all points
+  // every box of every color is cut into strips of TILE_ROWS rows, which
+  // are shared out between the calling thread and the pool. The strips'
+  // sums are then merged in order, so the result does not depend on the
+  // scheduling.
+  // image is bgr, unless isHSV says it has been converted already
   void findRanges(int output[][_numchannels][_numvalues],
-		   cv::Mat &image, std::vector<std::vector<cv::Rect> > &input)
-  {
-    //declarations    
-    cv::Point3_<uchar> *p;
-    int x, y;
-    int hue, sat, val;
-    int max_H, max_S, max_V, min_H, min_S, min_V;
-    double avg_H, avg_S, avg_V;
-    double stddev_H, stddev_S, stddev_V;
-    cv::Mat image_hsv;
-    std::vector<int> vecH, vecS, vecV;
-    
-    // convert to HSV
-    cvtColor(image, image_hsv, CV_BGR2HSV);
-    
-    // for each color to be processed
+		   cv::Mat &image, std::vector<std::vector<cv::Rect> > &input,
+		   bool isHSV = false)
+  {
+    std::vector<RangeTile> tiles;
+    cv::Rect bounds(0, 0, image.cols, image.rows);
+
+    // cut boxes into tiles, skipping anything outside of the image
     for (unsigned i = 0; i < input.size(); ++i)
     {
-      max_H = max_S = max_V = 0;
-      min_H = min_S = min_V = 255;
-      avg_H = avg_S = avg_V = 0;
-      stddev_H = stddev_S = stddev_V = 0;
-      // for all rectangles
       for (unsigned j = 0; j < input[i].size(); ++j)
       {
-        // cols
-        for (x = input[i][j].tl().x; x < input[i][j].br().x; ++x)
+        cv::Rect r = input[i][j] & bounds;
+        if (r.area() == 0)
+          continue;
+        for (int y = r.y; y < r.y + r.height; y += TILE_ROWS)
         {
-          // rows
-          for (y = input[i][j].tl().y; y < input[i][j].br().y; ++y)
-          {
-            // retrieve point at x, y
-            p = image_hsv.ptr<cv::Point3_<uchar> >(y, x);
-            
-            // retrieve hsv
-            hue = p -> x;
-            sat = p -> y;
-            val = p -> z;
-            
-            // update max/min
-            if (hue > max_H)
-              max_H = hue;
-            if (hue < min_H)
-              min_H = hue;
-            
-            if (sat > max_S)
-              max_S = sat;
-            if (sat < min_S)
-              min_S = sat;
-            
-            if (val > max_V)
-              max_V = val;
-            if (val < min_V)
-              min_V = val;
-            
-            //push to temp vecs for mean/stddev calculation
-            vecH.push_back(hue);
-            vecS.push_back(sat);
-            vecV.push_back(val);
-          }
+          RangeTile tile;
+          tile.color = i;
+          tile.rows = cv::Rect(r.x, y, r.width,
+                               std::min(TILE_ROWS, r.y + r.height - y));
+          tiles.push_back(tile);
         }
       }
-	
-      if (input[i].size() != 0)
+    }
+
+    // hand the tiles to the pool, only worth waking it for more than one.
+    // Once they are all done the job is taken away again, so a worker
+    // waking up late finds nothing to do instead of a dead vector.
+    {
+      boost::mutex::scoped_lock lock(rangeLock);
+      rangeImage = &image;
+      rangeIsHSV = isHSV;
+      rangeTiles = &tiles;
+      rangeNext = 0;
+      if (tiles.size() > 1)
       {
-        // calculate avgs
-        avg_H = std::accumulate(vecH.begin(), vecH.end(), 0);
-        avg_H /= vecH.size();
-        
-        avg_S = std::accumulate(vecS.begin(), vecS.end(), 0);
-        avg_S /= vecS.size();
-        
-        avg_V = std::accumulate(vecV.begin(), vecV.end(), 0);
-        avg_V /= vecV.size();
-        
-        //initialize other vectors for stddev
-        std::vector<int> zero_mean_H(vecH);
-        std::vector<int> zero_mean_S(vecS);
-        std::vector<int> zero_mean_V(vecV);
-        std::transform(zero_mean_H.begin(),
-              	  zero_mean_H.end(), zero_mean_H.begin(),
-              	  std::bind2nd(std::minus<int>(), avg_H));
-        
-        std::transform(zero_mean_S.begin(),
-              	  zero_mean_S.end(), zero_mean_S.begin(),
-              	  std::bind2nd(std::minus<int>(), avg_S));
-        
-        std::transform(zero_mean_V.begin(),
-              	  zero_mean_V.end(), zero_mean_V.begin(),
-              	  std::bind2nd(std::minus<int>(), avg_V));
-        
-        //calculate deviation with std, would be faster with boost
-        int deviation = std::inner_product(zero_mean_H.begin(),
-              			     zero_mean_H.end(),
-              			     zero_mean_H.begin(), 0);
-        stddev_H = std::sqrt(deviation / (vecH.size() - 1));
-        
-        deviation = std::inner_product(zero_mean_S.begin(),
-              			 zero_mean_S.end(),
-              			 zero_mean_S.begin(), 0);
-        stddev_S = std::sqrt(deviation / (vecS.size() - 1));
-        
-        deviation = std::inner_product(zero_mean_V.begin(),
-              			 zero_mean_V.end(),
-              			 zero_mean_V.begin(), 0);
-        stddev_V = std::sqrt(deviation / (vecV.size() - 1));
-        
-        output[i][_H][_max] = max_H; output[i][_H][_min] = min_H;
-        output[i][_H][_avg] = static_cast<int>(avg_H); 
-        output[i][_H][_stddev] = static_cast<int>(stddev_H);
-        
-        output[i][_S][_max] = max_S; output[i][_S][_min] = min_S;
-        output[i][_S][_avg] = static_cast<int>(avg_S); 
-        output[i][_S][_stddev] = static_cast<int>(stddev_S);
-        
-        output[i][_V][_max] = max_V; output[i][_V][_min] = min_V;
-        output[i][_V][_avg] = static_cast<int>(avg_V);
-        output[i][_V][_stddev] = static_cast<int>(stddev_V);
+        ++rangeJob;
+        rangeWork.notify_all();
+      }
+      takeTiles(lock);
+      while (rangeBusy > 0)
+        rangeDone.wait(lock);
+      rangeImage = 0;
+      rangeTiles = 0;
+    }
 
-      } else {
+    // for each color to be processed
+    for (unsigned i = 0; i < _numcolors; ++i)
+    {
+      int64_t count = 0;
+      int64_t sum[_numchannels] = { 0, 0, 0 }, sumSq[_numchannels] = { 0, 0, 0 };
+      int max[_numchannels] = { 0, 0, 0 }, min[_numchannels] = { 255, 255, 255 };
+
+      for (unsigned t = 0; t < tiles.size(); ++t)
+      {
+        if (tiles[t].color != i)
+          continue;
+        count += tiles[t].count;
+        for (int c = 0; c < _numchannels; ++c)
+        {
+          sum[c] += tiles[t].sum[c];
+          sumSq[c] += tiles[t].sumSq[c];
+          max[c] = std::max(max[c], tiles[t].max[c]);
+          min[c] = std::min(min[c], tiles[t].min[c]);
+        }
+      }
+
+      if (count == 0)
+      {
         // flag for nonexistant color
         output[i][_H][_avg] = -1234;
+        continue;
       }
 
-      //reinit vectors to empty
-      vecH = std::vector<int>();
-      vecS = std::vector<int>();
-      vecV = std::vector<int>();
-      
+      for (int c = 0; c < _numchannels; ++c)
+      {
+        // the mean is truncated before the deviation is taken, and the
+        // variance is an integer division, as it always has been
+        int64_t avg = static_cast<int64_t>(static_cast<double>(sum[c]) / count);
+        int64_t deviation = sumSq[c] - 2 * avg * sum[c] + count * avg * avg;
+        double stddev = 0;
+        if (count > 1)
+          stddev = std::sqrt(static_cast<double>(deviation / (count - 1)));
+
+        output[i][c][_max] = max[c]; output[i][c][_min] = min[c];
+        output[i][c][_avg] = static_cast<int>(avg);
+        output[i][c][_stddev] = static_cast<int>(stddev);
+      }
     }
     return;
   }
@@ -361,6 +455,22 @@ class CCUtil
   // last argument is what you want your yaml file to be
   void doAll(cv::Mat &image, std::map<std::string, 
               std::vector<cv::Rect> > &input, int channel)
+  {
+    std::vector<std::vector<std::vector<int> > > output_final;
+
+    createThresholds(output_final, image, input);
+
+    // output_YAML
+    output_YAML(output_final, channel); 
+
+    // clear colorUsed vector for next 
+    colorUsed.clear(); 
+  }
+
+  // the thresholds doAll saves, each one's color goes in colorUsed
+  void createThresholds(std::vector<std::vector<std::vector<int> > > &output_final,
+                        cv::Mat &image, std::map<std::string, 
+                        std::vector<cv::Rect> > &input, bool isHSV = false)
   {
     // create wrapper output format
     int output[_numcolors][_numchannels][_numvalues];
@@ -368,7 +478,6 @@ class CCUtil
     int hue_upper, sat_upper, val_upper;
 
     std::vector<std::vector<cv::Rect> > recVec;
-    std::vector<std::vector<std::vector<int> > > output_final;
 
     // create a map that contains the name of the color for each group of squares
     std::map<std::string, std::vector<cv::Rect> >::iterator it;
@@ -382,22 +491,8 @@ class CCUtil
     cvtMapToVec(recVec, input);
 
     // call findRanges
-    findRanges(output, image, recVec);
+    findRanges(output, image, recVec, isHSV);
     
-    // Unpretty fix to LABELLING issue:
-    std::map<std::string, std::vector<cv::Rect> >::iterator abIt;
-    std::vector<std::string> tmpColors;
- 
-    for (abIt = allBoxes.begin(); abIt != allBoxes.end(); ++abIt)
-    {
-        if( !(abIt->second).empty() )
-        {
-                //ROS_INFO("doAll colors used: %s", (abIt->first).c_str());
-                tmpColors.push_back(abIt->first);
-        }
-    }
-
-    std::vector<std::string>::iterator cIt = tmpColors.begin();
     bool isWrapped = false;
 
     for (unsigned i = 0; i < _numcolors; ++i)
@@ -482,26 +577,44 @@ class CCUtil
         temp_vec = std::vector<std::vector<int> >();
       }
 
-      // push back current color
-      colorUsed.push_back(*cIt);
-      //ROS_INFO("push back: %s", (*cIt).c_str());
+      // push back current color, colorNames lines up with output
+      colorUsed.push_back(colorNames[i]);
       // if color is wrapped color again (2 threshs, 2 colors) 
       if(isWrapped)
       {
-         colorUsed.push_back(*cIt);
-         //ROS_INFO("push back (wrapped): %s", (*cIt).c_str());
+         colorUsed.push_back(colorNames[i]);
 	 isWrapped = false;
       } 
-     
-      // increment color pointer
-      ++cIt;
     }
-    // output_YAML
-    output_YAML(output_final, channel); 
+  }
 
-    // clear colorUsed vector for next 
-    colorUsed.clear(); 
+  // rebuild the live preview's segmenter from the boxes drawn so far,
+  // measured the same way doAll would. processFrame hands it rawFrame
+  // in hsv, so the preview shows what space would save right now.
+  void updateSegmenter(const cv::Mat &hsv)
+  {
+    std::vector<std::vector<std::vector<int> > > output_final;
+    cv::Mat image = hsv;
+
+    createThresholds(output_final, image, allBoxes, true);
 
+    segmenter.clear();
+    for (unsigned i = 0; i < output_final.size(); ++i)
+      segmenter.addThreshold(colorUsed[i],
+                             output_final[i][0][0], output_final[i][0][1],
+                             output_final[i][0][2], output_final[i][1][0],
+                             output_final[i][1][1], output_final[i][1][2]);
+    colorUsed.clear();
+
+    // the overlay color of each label
+    maskColors.assign(1, cv::Vec3b());
+    for (unsigned label = 1; label <= segmenter.numLabels(); ++label)
+    {
+      cv::Scalar c = colors[segmenter.colorName(label)];
+      cv::Vec3b bgr;
+      bgr[0] = c[0]; bgr[1] = c[1]; bgr[2] = c[2];
+      maskColors.push_back(bgr);
+    }
   }
   
   // updates the command line interface in the terminal window
@@ -509,6 +622,9 @@ class CCUtil
   // again, nothing fancy.
   void printCLI()
   {
+    if (isHeadless)
+      return;
+
     std::cout << 
       "\ncontrols:\n\n" <<
       "  - draw a box by clicking & dragging\n\n" <<
@@ -524,6 +640,7 @@ class CCUtil
       "      purple: '5'\n" <<
       "      yellow: '6'\n\n" <<
       "  - undo a box by pressing 'u'\n\n" <<
+      "  - show/hide what the thresholds pick up with 'm'\n\n" <<
       "  - confirm your selections by pressing 'space'\n\n" <<
       "  - exit with 'ctrl-c'\n\n" <<
       "----------------------------------------------------\n" <<
@@ -551,7 +668,7 @@ class CCUtil
         // create the actual rectangle object, to be displayed 
         // on the current frame in the imageCb function
         cv::rectangle(
-          currentFrame,
+          displayFrame,
           cv::Point(it_boxes->x, it_boxes->y),
           cv::Point(it_boxes->x + it_boxes->width,
                     it_boxes->y + it_boxes->height),
@@ -565,9 +682,9 @@ class CCUtil
   // corner of ccUtil's opencv window
   void showSaveMsg()
   {
-    cv::putText(currentFrame,
+    cv::putText(displayFrame,
                 currentCalibrationStr + " calibration saved.",
-                cv::Point(20, currentFrame.rows - 20), 
+                cv::Point(20, displayFrame.rows - 20), 
                 CV_FONT_HERSHEY_SIMPLEX, 
                 0.8, 
                 cv::Scalar(0, 0, 255));
@@ -578,7 +695,9 @@ class CCUtil
     // we pass in 'this' as an optional argument to the "handler," which
     // is really the handler wrapper, which secretly and nefariously
     // uses 'this' CCUI instance to grab the true callback function
-    static_cast<CCUtil*>(this_)->mouseCb(event, x, y, flags, 0);
+    CCUtil *ccutil = static_cast<CCUtil*>(this_);
+    ccutil->recordMouse(event, x, y, flags);
+    ccutil->mouseCb(event, x, y, flags, 0);
   }
 
   // Let the user draw a box with the mouse.
@@ -626,27 +745,271 @@ class CCUtil
     }
   }
 
-  // this is where most of the front end's work occurs
-  void imageCb(const sensor_msgs::ImageConstPtr& msg)
+  // write the header of a record to the recording, if we are recording
+  bool recordHeader(unsigned char type)
   {
-    cv_bridge::CvImagePtr cv_in;
+    if (!recording.is_open())
+      return false;
 
-    // try to grab an image from a topic specified in
-    // the CCUtil constructor
-    try
+    double stamp = (ros::WallTime::now() - recordStart).toSec();
+    writeRaw(recording, type);
+    writeRaw(recording, stamp);
+    return true;
+  }
+
+  // only the events mouseCb acts on are recorded, which keeps the
+  // recording small when the mouse is just wandering around
+  void recordMouse(int event, int x, int y, int flags)
+  {
+    bool matters = (event == CV_EVENT_MOUSEMOVE && isDrawingBox) ||
+                   event == CV_EVENT_LBUTTONDOWN ||
+                   event == CV_EVENT_LBUTTONUP;
+    if (!matters || !recordHeader(_rec_mouse))
+      return;
+
+    int32_t payload[4] = { event, x, y, flags };
+    recording.write(reinterpret_cast<const char*>(payload), sizeof(payload));
+  }
+
+  void recordKey(int key)
+  {
+    if (!recordHeader(_rec_key))
+      return;
+
+    writeRaw(recording, static_cast<int32_t>(key));
+    recording.flush();
+  }
+
+  // frames are stored as png, lossless so a replay sees the same pixels.
+  // A frame identical to the last one is just a header.
+  void recordFrame(const cv::Mat &frame)
+  {
+    if (!recording.is_open())
+      return;
+
+    if (sameFrame(frame, lastRecorded))
     {
-      cv_in = cv_bridge::toCvCopy(msg, enc::BGR8);
+      recordHeader(_rec_repeat);
+      return;
     }
-    catch (cv_bridge::Exception& e)
-    {
-      ROS_ERROR("cv_bridge exception: %s", e.what());
+    lastRecorded = frame.clone();
+
+    recordHeader(_rec_frame);
+    std::vector<uchar> buf;
+    std::vector<int> params;
+    params.push_back(CV_IMWRITE_PNG_COMPRESSION);
+    params.push_back(REC_PNG_COMPRESSION);
+    cv::imencode(".png", frame, buf, params);
+    writeRaw(recording, static_cast<uint32_t>(buf.size()));
+    recording.write(reinterpret_cast<const char*>(&buf[0]), buf.size());
+    recording.flush();
+  }
+
+  // the yaml doAll just wrote, so a replay can check it writes the same
+  void recordYAML(int channel)
+  {
+    if (!recordHeader(_rec_yaml))
       return;
+
+    std::string contents = readFile(yamlFile(channel));
+    writeRaw(recording, static_cast<int32_t>(channel));
+    writeRaw(recording, static_cast<uint32_t>(contents.size()));
+    recording.write(contents.data(), contents.size());
+    recording.flush();
+  }
+
+  static bool sameFrame(const cv::Mat &a, const cv::Mat &b)
+  {
+    if (a.size() != b.size() || a.type() != b.type())
+      return false;
+
+    size_t rowBytes = a.cols * a.elemSize();
+    for (int y = 0; y < a.rows; ++y)
+      if (std::memcmp(a.ptr(y), b.ptr(y), rowBytes) != 0)
+        return false;
+    return true;
+  }
+
+  template <typename T>
+  static void writeRaw(std::ostream &os, const T &value)
+  {
+    os.write(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  template <typename T>
+  static bool readRaw(std::istream &is, T &value)
+  {
+    is.read(reinterpret_cast<char*>(&value), sizeof(T));
+    return !is.fail();
+  }
+
+  static bool readBytes(std::istream &is, std::vector<char> &buf)
+  {
+    uint32_t size;
+    if (!readRaw(is, size))
+      return false;
+    buf.resize(size);
+    if (size > 0)
+      is.read(&buf[0], size);
+    return !is.fail();
+  }
+
+  static std::string readFile(const std::string &name)
+  {
+    std::ifstream in(name.c_str(), std::ios::in | std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in),
+                       std::istreambuf_iterator<char>());
+  }
+
+  // feed a recorded session back through the same code imageCb and
+  // mouseCb use, as fast as possible. Prints per frame latency and
+  // returns false if a saved yaml differs from the recorded one.
+  bool replay(const std::string &file)
+  {
+    std::ifstream in(file.c_str(), std::ios::in | std::ios::binary);
+    char magic[sizeof(REC_MAGIC) - 1];
+    in.read(magic, sizeof(magic));
+    if (!in || std::memcmp(magic, REC_MAGIC, sizeof(magic)) != 0)
+    {
+      ROS_ERROR("\"%s\" is not a cc_util recording", file.c_str());
+      return false;
+    }
+
+    // frames are split by whether the preview had anything to do,
+    // so its cost shows up next to the plain frame cost
+    std::vector<double> latencies, previewLatencies, plainLatencies;
+    double busy = 0.0; // time spent handling events since the last frame
+    int yamls = 0, mismatches = 0;
+    unsigned char type;
+    double stamp;
+    ros::WallTime start = ros::WallTime::now();
+
+    // if the node died while recording, the last record can be cut
+    // short. Everything before it is still good, so just stop there.
+    while (readRaw(in, type))
+    {
+      ros::WallTime t;
+
+      if (!readRaw(in, stamp))
+      {
+        ROS_WARN("recording \"%s\" ends in a partial record, stopping there",
+                 file.c_str());
+        break;
+      }
+
+      switch (type) {
+      case _rec_mouse:
+      {
+        int32_t payload[4];
+        if (!readRaw(in, payload))
+          break;
+        t = ros::WallTime::now();
+        mouseCb(payload[0], payload[1], payload[2], payload[3], 0);
+        busy += (ros::WallTime::now() - t).toSec();
+        continue;
+      }
+      case _rec_key:
+      {
+        int32_t key;
+        if (!readRaw(in, key))
+          break;
+        t = ros::WallTime::now();
+        handleKey(key);
+        busy += (ros::WallTime::now() - t).toSec();
+        continue;
+      }
+      case _rec_frame:
+      {
+        std::vector<char> buf;
+        if (!readBytes(in, buf) || buf.empty())
+          break;
+        lastRecorded = cv::imdecode(cv::Mat(1, buf.size(), CV_8U, &buf[0]),
+                                    CV_LOAD_IMAGE_COLOR);
+      }
+      // fall through, the frame is now the last one
+      case _rec_repeat:
+      {
+        if (lastRecorded.empty())
+        {
+          ROS_ERROR("repeated frame with no frame before it at %.3fs", stamp);
+          return false;
+        }
+        bool previewing = showMask && !boxColors.empty();
+        t = ros::WallTime::now();
+        processFrame(lastRecorded);
+        busy += (ros::WallTime::now() - t).toSec();
+        latencies.push_back(busy);
+        (previewing ? previewLatencies : plainLatencies).push_back(busy);
+        ROS_DEBUG("frame %u at %.3fs: %.3f ms",
+                  (unsigned)latencies.size(), stamp, busy * 1000.0);
+        busy = 0.0;
+        continue;
+      }
+      case _rec_yaml:
+      {
+        int32_t channel;
+        std::vector<char> buf;
+        if (!readRaw(in, channel) || !readBytes(in, buf))
+          break;
+        ++yamls;
+        if (readFile(yamlFile(channel)) != std::string(buf.begin(), buf.end()))
+        {
+          ROS_ERROR("yaml saved at %.3fs differs from the recording: %s",
+                    stamp, yamlFile(channel).c_str());
+          ++mismatches;
+        }
+        continue;
+      }
+      default:
+        ROS_ERROR("unknown record type %d at %.3fs", type, stamp);
+        return false;
+      }
+
+      ROS_WARN("recording \"%s\" ends in a partial record at %.3fs, "
+               "stopping there", file.c_str(), stamp);
+      break;
     }
 
-    // get a keypress
-    switch (cv::waitKey(10)) {
+    double total = (ros::WallTime::now() - start).toSec();
+    if (latencies.empty())
+    {
+      ROS_ERROR("recording \"%s\" has no frames", file.c_str());
+      return false;
+    }
+
+    ROS_INFO("replayed %u frames in %.3f s", (unsigned)latencies.size(), total);
+    reportLatency("all frames", latencies);
+    reportLatency("with preview ('m' on, boxes drawn)", previewLatencies);
+    reportLatency("without preview", plainLatencies);
+    ROS_INFO("%d of %d saved yaml files match the recording",
+             yamls - mismatches, yamls);
+
+    return mismatches == 0;
+  }
+
+  // mean/median/p99/max of some per frame latencies, if there are any
+  static void reportLatency(const char *what, std::vector<double> latencies)
+  {
+    if (latencies.empty())
+      return;
+
+    std::sort(latencies.begin(), latencies.end());
+    double sum = std::accumulate(latencies.begin(), latencies.end(), 0.0);
+    ROS_INFO("%s, %u frames, latency (ms): mean %.3f  median %.3f  "
+             "p99 %.3f  max %.3f", what, (unsigned)latencies.size(),
+             sum / latencies.size() * 1000.0,
+             latencies[latencies.size() / 2] * 1000.0,
+             latencies[(latencies.size() * 99) / 100] * 1000.0,
+             latencies.back() * 1000.0);
+  }
+
+  // act on a keypress, as returned by cv::waitKey
+  void handleKey(int key)
+  {
+    switch (key) {
     case 32: // spacebar, save a calibration based on the boxes drawn
-      doAll(currentFrame, allBoxes, currentCalibration);
+      doAll(rawFrame, allBoxes, currentCalibration);
+      recordYAML(currentCalibration);
       framesToShowSaveMsg = 10;
       allBoxes.clear();
       boxColors.clear();
@@ -678,6 +1041,9 @@ class CCUtil
     case 117: // u, undo last box
       undoBox();
       break;
+    case 109: // m, toggle the threshold preview
+      showMask = !showMask;
+      break;
     case 91:  // [, edit sunny calibration
       currentCalibration = 0;
       currentCalibrationStr = "sunny";
@@ -694,9 +1060,50 @@ class CCUtil
       printCLI();
       break;
     }
+  }
+
+  // tint every pixel the current boxes' thresholds would pick up
+  void drawMask()
+  {
+    if (!showMask || segmenter.empty())
+      return;
 
-    // update the frame for display
-    currentFrame = cv_in->image.clone();
+    segmenter.segment(hsvFrame, maskLabels);
+
+    for (int y = 0; y < displayFrame.rows; ++y)
+    {
+      const uchar *label = maskLabels.ptr<uchar>(y);
+      cv::Vec3b *p = displayFrame.ptr<cv::Vec3b>(y);
+      for (int x = 0; x < displayFrame.cols; ++x)
+      {
+        if (!label[x])
+          continue;
+        const cv::Vec3b &c = maskColors[label[x]];
+        p[x][0] = (p[x][0] + c[0]) / 2;
+        p[x][1] = (p[x][1] + c[1]) / 2;
+        p[x][2] = (p[x][2] + c[2]) / 2;
+      }
+    }
+  }
+
+  // make a new frame the current one and draw our stuff on it.
+  // rawFrame is left clean, everything is drawn on displayFrame.
+  void processFrame(const cv::Mat &frame)
+  {
+    rawFrame = frame.clone();
+    displayFrame = rawFrame.clone();
+
+    // the thresholds follow the boxes and the frame they would be
+    // measured on, so they are redone every frame. One hsv conversion
+    // serves both them and the mask.
+    if (showMask && !boxColors.empty())
+    {
+      cvtColor(rawFrame, hsvFrame, CV_BGR2HSV);
+      updateSegmenter(hsvFrame);
+    }
+    else
+      segmenter.clear();
+    drawMask();
 
     // show "________ calibration saved."
     // framesToShowSaveMsg is initialized to 10
@@ -706,16 +1113,88 @@ class CCUtil
       framesToShowSaveMsg--;
     }
 
-    // add the boxes the user has drawn to the current frame.
+    // add the boxes the user has drawn to the display frame.
     drawBoxes();
-    cv::imshow(WINDOW, currentFrame);
+  }
+
+  // this is where most of the front end's work occurs
+  void imageCb(const sensor_msgs::ImageConstPtr& msg)
+  {
+    cv_bridge::CvImagePtr cv_in;
+
+    // try to grab an image from a topic specified in
+    // the CCUtil constructor
+    try
+    {
+      cv_in = cv_bridge::toCvCopy(msg, enc::BGR8);
+    }
+    catch (cv_bridge::Exception& e)
+    {
+      ROS_ERROR("cv_bridge exception: %s", e.what());
+      return;
+    }
+
+    // get a keypress, mouse events are handled in here too
+    int key = cv::waitKey(10);
+    if (key != -1)
+      recordKey(key);
+    handleKey(key);
+
+    recordFrame(cv_in->image);
+    processFrame(cv_in->image);
+    cv::imshow(WINDOW, displayFrame);
   }
 };
 
+static const char USAGE[] =
+  "usage: cc_util [--path DIR] [--record FILE | --replay FILE]\n";
+
+// usage: see USAGE, anything else is refused rather than ignored
 int main(int argc, char** argv)
 {
   ros::init(argc, argv, "cc_util");
-  CCUtil CCUI;
+
+  std::string path, recordFile, replayFile;
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string *value = 0;
+    if (std::strcmp(argv[i], "--path") == 0)
+      value = &path;
+    else if (std::strcmp(argv[i], "--record") == 0)
+      value = &recordFile;
+    else if (std::strcmp(argv[i], "--replay") == 0)
+      value = &replayFile;
+
+    if (!value || i + 1 >= argc || argv[i + 1][0] == '\0' ||
+        std::strncmp(argv[i + 1], "--", 2) == 0)
+    {
+      std::cerr << "cc_util: " << (value ? "missing value for " : "unknown argument ")
+                << argv[i] << "\n" << USAGE;
+      return 1;
+    }
+    *value = argv[++i];
+  }
+
+  if (!recordFile.empty() && !replayFile.empty())
+  {
+    std::cerr << "cc_util: --record and --replay can't be used together\n"
+              << USAGE;
+    return 1;
+  }
+
+  // replays write their yaml somewhere harmless unless told otherwise
+  if (path.empty())
+    path = replayFile.empty() ? PATH : REPLAY_PATH;
+  if (path[path.size() - 1] != '/')
+    path += '/';
+
+  if (!replayFile.empty())
+  {
+    CCUtil CCUI(path, "", true);
+    return CCUI.replay(replayFile) ? 0 : 1;
+  }
+
+  CCUtil CCUI(path, recordFile, false);
   ros::spin();
   return 0;
 }
@@ -0,0 +1,140 @@
+#include <cc_util/segmenter.h>
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// one row of hsv pixels
+static cv::Mat hsvRow(const std::vector<cv::Vec3b> &pixels)
+{
+  cv::Mat hsv(1, pixels.size(), CV_8UC3);
+  for (unsigned i = 0; i < pixels.size(); ++i)
+    hsv.at<cv::Vec3b>(0, i) = pixels[i];
+  return hsv;
+}
+
+// { { h_l, s_l, v_l }, { h_u, s_u, v_u } }, as doAll makes them
+static std::vector<std::vector<int> > threshold(int h_l, int s_l, int v_l,
+                                                int h_u, int s_u, int v_u)
+{
+  std::vector<std::vector<int> > t(2, std::vector<int>(3));
+  t[0][0] = h_l; t[0][1] = s_l; t[0][2] = v_l;
+  t[1][0] = h_u; t[1][1] = s_u; t[1][2] = v_u;
+  return t;
+}
+
+TEST(ColorSegmenter, HueWrappedPairSharesLabel)
+{
+  cc_util::ColorSegmenter segmenter;
+  segmenter.addThreshold("RED", 0, 100, 100, 10, 255, 255);
+  segmenter.addThreshold("RED", 170, 100, 100, 179, 255, 255);
+  segmenter.addThreshold("GREEN", 50, 100, 100, 70, 255, 255);
+  ASSERT_EQ(2u, segmenter.numLabels());
+  EXPECT_EQ("RED", segmenter.colorName(1));
+  EXPECT_EQ("GREEN", segmenter.colorName(2));
+
+  std::vector<cv::Vec3b> pixels;
+  pixels.push_back(cv::Vec3b(5, 200, 200));   // low red
+  pixels.push_back(cv::Vec3b(175, 200, 200)); // high red
+  pixels.push_back(cv::Vec3b(60, 200, 200));  // green
+  pixels.push_back(cv::Vec3b(90, 200, 200));  // no hue matches
+  pixels.push_back(cv::Vec3b(5, 50, 200));    // red hue, too grey
+  cv::Mat labels;
+  segmenter.segment(hsvRow(pixels), labels);
+
+  ASSERT_EQ(CV_8UC1, labels.type());
+  EXPECT_EQ(1, labels.at<uchar>(0, 0));
+  EXPECT_EQ(1, labels.at<uchar>(0, 1));
+  EXPECT_EQ(2, labels.at<uchar>(0, 2));
+  EXPECT_EQ(0, labels.at<uchar>(0, 3));
+  EXPECT_EQ(0, labels.at<uchar>(0, 4));
+}
+
+TEST(ColorSegmenter, FirstAddedWins)
+{
+  std::vector<cv::Vec3b> pixels;
+  pixels.push_back(cv::Vec3b(125, 200, 200)); // inside both
+  pixels.push_back(cv::Vec3b(140, 200, 200)); // purple only
+  cv::Mat labels;
+
+  cc_util::ColorSegmenter blueFirst;
+  blueFirst.addThreshold("BLUE", 100, 0, 0, 130, 255, 255);
+  blueFirst.addThreshold("PURPLE", 120, 0, 0, 150, 255, 255);
+  blueFirst.segment(hsvRow(pixels), labels);
+  EXPECT_EQ("BLUE", blueFirst.colorName(labels.at<uchar>(0, 0)));
+  EXPECT_EQ("PURPLE", blueFirst.colorName(labels.at<uchar>(0, 1)));
+
+  cc_util::ColorSegmenter purpleFirst;
+  purpleFirst.addThreshold("PURPLE", 120, 0, 0, 150, 255, 255);
+  purpleFirst.addThreshold("BLUE", 100, 0, 0, 130, 255, 255);
+  purpleFirst.segment(hsvRow(pixels), labels);
+  EXPECT_EQ("PURPLE", purpleFirst.colorName(labels.at<uchar>(0, 0)));
+  EXPECT_EQ("PURPLE", purpleFirst.colorName(labels.at<uchar>(0, 1)));
+}
+
+TEST(ColorSegmenter, LoadsWhatCCUtilSaves)
+{
+  std::string file = std::string(P_tmpdir) + "/cc_util_test_segmenter.yml";
+  std::vector<std::vector<std::vector<int> > > thresholds;
+  std::vector<std::string> names;
+  thresholds.push_back(threshold(0, 100, 100, 10, 255, 255));
+  names.push_back("RED");
+  thresholds.push_back(threshold(170, 100, 100, 179, 255, 255));
+  names.push_back("RED");
+  thresholds.push_back(threshold(50, 100, 100, 70, 255, 255));
+  names.push_back("GREEN");
+  {
+    cv::FileStorage fs(file, cv::FileStorage::WRITE);
+    cc_util::writeColors(fs, thresholds, names);
+  }
+
+  cc_util::ColorSegmenter segmenter;
+  ASSERT_TRUE(segmenter.load(file));
+  ASSERT_EQ(2u, segmenter.numLabels());
+  EXPECT_EQ("RED", segmenter.colorName(1));
+  EXPECT_EQ("GREEN", segmenter.colorName(2));
+
+  std::vector<cv::Vec3b> pixels;
+  pixels.push_back(cv::Vec3b(175, 200, 200));
+  pixels.push_back(cv::Vec3b(60, 200, 200));
+  cv::Mat labels;
+  segmenter.segment(hsvRow(pixels), labels);
+  EXPECT_EQ(1, labels.at<uchar>(0, 0));
+  EXPECT_EQ(2, labels.at<uchar>(0, 1));
+
+  std::remove(file.c_str());
+}
+
+TEST(ColorSegmenter, FailedLoadLeavesNothingLoaded)
+{
+  std::string file = std::string(P_tmpdir) + "/cc_util_test_segmenter.yml";
+  std::vector<std::vector<std::vector<int> > > thresholds;
+  std::vector<std::string> names;
+  for (unsigned i = 0; i <= cc_util::ColorSegmenter::MAX_THRESHOLDS; ++i)
+  {
+    thresholds.push_back(threshold(i, 0, 0, i, 255, 255));
+    names.push_back("BLUE");
+  }
+  {
+    cv::FileStorage fs(file, cv::FileStorage::WRITE);
+    cc_util::writeColors(fs, thresholds, names);
+  }
+
+  cc_util::ColorSegmenter segmenter;
+  segmenter.addThreshold("GREEN", 50, 100, 100, 70, 255, 255);
+  EXPECT_FALSE(segmenter.load(file));
+  EXPECT_TRUE(segmenter.empty());
+  EXPECT_EQ(0u, segmenter.numLabels());
+
+  std::remove(file.c_str());
+
+  segmenter.addThreshold("GREEN", 50, 100, 100, 70, 255, 255);
+  EXPECT_FALSE(segmenter.load(file));
+  EXPECT_TRUE(segmenter.empty());
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}